@@ -7,7 +7,11 @@
 
 #define SCREEN_WIDTH 80
 #define SCREEN_HEIGHT 25
-#define MAX_LINE_LENGTH 80
+#define MAX_LINE_LENGTH 256  // Logical line of up to 255 characters
+#define VISIBLE_COLUMNS 79   // Writing the last column would wrap the conio cursor
+#define PAN_STEP 20          // Columns kept in view when panning a long line
+#define MORE_MARKER '>'      // Last screen column of a line that continues
+#define MAX_SPANS 54         // Spans reaching the visible columns, two neighbours take 3 or more
 #define HEADER_LINES 2    // Number of lines used by header
 #define STATUS_LINE 24    // Last line of screen
 #define MAX_LINES 21      // 25 - HEADER_LINES - 1 spacing - 1 status line
@@ -21,17 +25,161 @@
 #define MD_MONO_COLOR     5      // Dark green for code
 #define MD_BACKGROUND     1      // White background
 
-// Screen buffer
-char screen_buffer[MAX_LINES][MAX_LINE_LENGTH];
+// Document storage: lines are packed back to back in text_pool in a
+// compressed form, only the line being edited is kept expanded
+// Prose packs to 0.7-0.8 bytes per character, so the pool holds about
+// 2000 characters in less memory than 21 fixed 80 character lines took
+#define TEXT_POOL_SIZE  1536
+#define CODE_LITERAL    0x01     // Next byte is stored as is
+#define CODE_SPACES_MAX 0x1F     // 0x02-0x1F encode runs of 2-31 spaces
+#define CODE_SHIFTED    0x60     // 0x60-0x7F encode shifted letters 0xC0-0xDF
+#define CODE_DIGRAM     0x80     // 0x80-0xFF index digram_table
+#define DIGRAM_COUNT    128
+
+// Common digrams, grouped by first character
+const char digram_table[DIGRAM_COUNT * 2 + 1] =
+    " t a s o i w c b h f p m d l r e n### **, . anataralasacaiada beco"
+    "cechcactd dedie erenesedeaeceletemf fog gehehahihoh inisiticioieil"
+    "irk lelll lilalylomemam mon ndngntnensnaninoonoro ofouowotompeprre"
+    "r rorirarss stsesissshsotht titetotatstrurutusunvewiwaw y ";
+
+unsigned char text_pool[TEXT_POOL_SIZE];
+unsigned int line_offset[MAX_LINES + 1];   // Line n is text_pool[line_offset[n]..line_offset[n+1]]
+unsigned char digram_index[0x40];          // First digram for characters 0x20-0x5F
+char edit_line[MAX_LINE_LENGTH];           // Expanded copy of the line being edited
+unsigned char edit_line_num = 0;
+char line_scratch[MAX_LINE_LENGTH];        // Decoded line returned by doc_line()
 unsigned char cursor_x = 0;
 unsigned char cursor_y = 0;
+unsigned char scroll_x = 0;                // First visible column of the cursor line
+
+// Highlighting of a line as runs of one color
+struct line_spans {
+    unsigned char count;
+    unsigned char end[MAX_SPANS];          // Column after the last character of each span
+    unsigned char color[MAX_SPANS];
+};
+
+struct line_spans cursor_spans;            // Cached for the cursor line so panning needs no parsing
+unsigned char cursor_spans_line = 0xFF;    // Line cursor_spans belongs to, 0xFF if stale
+unsigned char cursor_spans_col;            // First column cursor_spans was built for
+struct line_spans work_spans;              // Scratch spans for all other lines
 
 // C128 keyboard matrix locations for 80-column mode
 #define KBD_MATRIX_ROW    0xD6   // Keyboard row select
 #define KBD_MATRIX_COL    0xD4   // Keyboard column read
 #define KBD_SHIFT_REG     0xD3   // Shift key register
 
+// Export settings: output is streamed through a small fixed buffer
+#define EXPORT_BUF_SIZE   64
+#define EXPORT_LFN        2      // Logical file number for export output
+#define DISK_DEVICE       8
+#define DRIVE_CMD_LFN     15     // Drive command and status channel
+#define DRIVE_ERROR_MIN   20     // Status codes below this are not errors
+#define PRINTER_DEVICE    4
+#define PRINTER_LOWERCASE 7      // Printer secondary address for upper/lower case
+
+// Inline markdown spans, in the same order as the highlighting rules
+#define SPAN_NONE   0
+#define SPAN_BOLD   1
+#define SPAN_ITALIC 2
+#define SPAN_MONO   3
+
+// Viewer settings: files are read block by block through a direct
+// access channel, so any line can be reached from the nearest index mark
+#define VIEW_DATA_LFN     3      // Direct access buffer channel
+#define VIEW_MARKS        64     // Entries in the sparse line index
+#define VIEW_ROWS         MAX_LINES
+#define VIEW_LINE_LENGTH  (VISIBLE_COLUMNS + 1)
+#define DIR_TRACK         18     // Directory track on 1541/1571 disks
+#define DIR_SECTORS       19     // Sectors on the directory track
+
+struct view_mark {
+    unsigned char track;
+    unsigned char sector;
+    unsigned char offset;        // Position of the line start within the block
+    unsigned int line;
+};
+
+// Autosave journal: lines edited since the last checkpoint are appended
+// to the journal while the keyboard is idle
+#define JOURNAL_NAME         "md.jnl"
+#define JOURNAL_TEMP         "md.tmp"  // Snapshot until it replaces the journal
+#define JOURNAL_NAME_RECORD  ':'     // Record holding the main file name
+#define JOURNAL_IDLE_JIFFIES 60      // Idle time before writing, 1 second
+#define JOURNAL_COMPACT_RECS 64      // Records before compacting the journal
+#define JOURNAL_CHUNK        16      // Bytes written per step
+#define JOURNAL_IDLE         0       // No file open
+#define JOURNAL_WRITING      1       // Journal open, one record at a time
+#define JOURNAL_CLOSING      2       // Journal written, close it
+#define JOURNAL_COMPACTING   3       // Main file open, one line at a time
+#define JOURNAL_COMPACTED    4       // Main file written, close it
+#define JOURNAL_DROPPING     5       // Main file complete, remove the journal
+#define JOURNAL_SNAPSHOT     6       // Snapshot open, one record at a time
+#define JOURNAL_SNAPSHOTTED  7       // Snapshot written, close it
+#define JOURNAL_REPLACING    8       // Snapshot complete, remove the old journal
+#define JOURNAL_RENAMING     9       // Rename the snapshot to the journal
+#define JIFFY_CLOCK_LO       0xA2    // Low byte of the jiffy clock
+#define KBD_BUFFER_COUNT     0xD0    // Number of keys in the keyboard buffer
+
+// Idle-time scheduler: while no key is pending, background tasks run in
+// time slices measured with CIA 2 timer B, highest priority first
+#define TASK_COUNT        2
+#define CIA2_TIMER_B_LO   0xDD06
+#define CIA2_TIMER_B_HI   0xDD07
+#define CIA2_CTRL_B       0xDD0F
+#define TIMER_START       0x11   // Force load and start, counting system clock
+
+struct task {
+    unsigned char (*run)(void);  // Does one step, returns 0 when there is no work
+    unsigned int budget;         // Slice length in timer ticks (microseconds)
+};
+
+char export_buf[EXPORT_BUF_SIZE];
+unsigned char export_len = 0;
+unsigned char export_html = 0;   // 1 = HTML to disk, 0 = formatted text to printer
+unsigned char export_error = 0;  // Set when a write to the device fails
+
+char current_filename[17] = "";      // Empty until the document is saved or loaded
+unsigned char line_dirty[MAX_LINES];
+unsigned char journal_pending = 0;    // Dirty lines waiting to be written
+unsigned char journal_exists = 0;
+unsigned char journal_disabled = 0;   // Set when a journal could not be recovered
+unsigned char doc_altered = 0;        // Set when loading split or dropped text of the file
+unsigned char file_saved = 0;         // Set once current_filename was saved this session
+unsigned char doc_lines = 0;          // Lines read from the file, blank ones included
+unsigned char doc_open_end = 0;       // Set when the file's last line had no newline
+unsigned int journal_records = 0;
+unsigned char journal_state = JOURNAL_IDLE;
+FILE *journal_fp;                     // Open file while not idle
+char journal_buf[MAX_LINE_LENGTH + 3];  // Record or line being written
+unsigned int journal_len = 0;
+unsigned int journal_pos = 0;         // Bytes of journal_buf already written
+unsigned char compact_line;           // Next line to compact or snapshot
+unsigned char compact_last;           // Lines in the compacted document
+unsigned char last_key_jiffy;
+
+unsigned char line_stale[MAX_LINES];  // Lines waiting to be repainted
+
+unsigned char view_block[256];
+unsigned char view_track, view_sector;
+unsigned int view_pos, view_end;  // Read position and last data byte in view_block
+struct view_mark view_marks[VIEW_MARKS];
+unsigned char view_mark_count;
+unsigned int view_stride;         // Lines between index marks, doubles when full
+unsigned int view_total_lines;
+unsigned int view_next_line;      // Line the stream is positioned at
+unsigned char view_error;         // Set when a block read fails
+char view_window[VIEW_ROWS][VIEW_LINE_LENGTH];
+
 // Function prototypes
+void doc_init(void);
+void doc_clear(void);
+char *doc_line(unsigned char line_num);
+char *doc_edit(unsigned char line_num);
+unsigned char doc_store(unsigned char line_num, const char *text);
+unsigned char doc_room(unsigned char len);
+unsigned char read_document(FILE *fp);
 void init_screen(void);
 void format_current_line(void);
 void handle_input(void);
@@ -47,9 +195,249 @@ void draw_file_list(struct file_entry *files, unsigned char file_count, unsigned
                     unsigned char start_x, unsigned char start_y, unsigned char height);
 void apply_formatting(void);
 void format_line_without_cursor(unsigned char line_num);
+void draw_markdown_line(const char *line, unsigned char row);
+void markdown_spans(const char *line, struct line_spans *spans, unsigned char first_col);
+void draw_spans(const char *line, const struct line_spans *spans, unsigned char row, unsigned char first_col);
+void draw_cursor_line(void);
 void new_file(void);
+void input_filename(char *filename, unsigned char start_x, unsigned char start_y);
+void redraw_screen(void);
+void export_file(void);
+unsigned char drive_status(void);
+void view_file(void);
+void write_document(FILE *fp);
+void journal_mark(unsigned char line_num);
+void journal_close(void);
+void journal_reset(void);
+void journal_recover(void);
+void queue_repaint_all(void);
+unsigned char task_repaint(void);
+unsigned char task_autosave(void);
+void run_idle_tasks(void);
+
+// Background tasks in priority order
+struct task tasks[TASK_COUNT] = {
+    { task_repaint,  4000 },
+    { task_autosave, 1000 }
+};
 
 // Function implementations
+void doc_init(void) {
+    unsigned char i;
+    
+    // Index the digram table by first character for the encoder
+    memset(digram_index, 0xFF, sizeof(digram_index));
+    for(i = DIGRAM_COUNT; i-- > 0; ) {
+        digram_index[(unsigned char)digram_table[i * 2] - 0x20] = i;
+    }
+    doc_clear();
+}
+
+void doc_clear(void) {
+    memset(line_offset, 0, sizeof(line_offset));
+    cursor_spans_line = 0xFF;
+    edit_line[0] = '\0';
+    edit_line_num = 0;
+    doc_altered = 0;
+    doc_lines = 0;
+    doc_open_end = 0;
+}
+
+// Packs a line into dst, or only measures it when dst is NULL
+unsigned int encode_line(const char *src, unsigned char *dst) {
+    unsigned int out = 0;
+    unsigned char c, k, n, code;
+    
+    while((c = *src) != '\0') {
+        n = 1;  // Characters taken by this code
+        
+        if(c == ' ' && src[1] == ' ') {
+            // Runs of spaces
+            n = 2;
+            while(src[n] == ' ' && n < CODE_SPACES_MAX) n++;
+            code = n;
+        }
+        else if(c >= 0xC0 && c <= 0xDF) {
+            // Capitals take one byte in the codes keyboard input never produces
+            code = c - 0xC0 + CODE_SHIFTED;
+        }
+        else if(c < 0x20 || c >= CODE_SHIFTED) {
+            if(dst) dst[out] = CODE_LITERAL;
+            out++;
+            code = c;
+        }
+        else {
+            code = c;
+            
+            // Digrams starting with this character are stored together
+            k = digram_index[c - 0x20];
+            if(k != 0xFF) {
+                while(k < DIGRAM_COUNT && digram_table[k * 2] == c) {
+                    if(digram_table[k * 2 + 1] == src[1]) break;
+                    k++;
+                }
+                if(k < DIGRAM_COUNT && digram_table[k * 2] == c) {
+                    code = CODE_DIGRAM | k;
+                    n = 2;
+                }
+            }
+        }
+        if(dst) dst[out] = code;
+        out++;
+        src += n;
+    }
+    return out;
+}
+
+void decode_line(unsigned char line_num, char *dst) {
+    const unsigned char *src = text_pool + line_offset[line_num];
+    const unsigned char *end = text_pool + line_offset[line_num + 1];
+    unsigned char c;
+    
+    while(src < end) {
+        c = *src++;
+        if(c >= CODE_DIGRAM) {
+            c = (c & 0x7F) * 2;
+            *dst++ = digram_table[c];
+            *dst++ = digram_table[c + 1];
+        }
+        else if(c >= CODE_SHIFTED) {
+            *dst++ = c - CODE_SHIFTED + 0xC0;
+        }
+        else if(c >= 0x20) {
+            *dst++ = c;
+        }
+        else if(c == CODE_LITERAL) {
+            *dst++ = *src++;
+        }
+        else {
+            memset(dst, ' ', c);
+            dst += c;
+        }
+    }
+    *dst = '\0';
+}
+
+// Resizes a line's slot, growing only if reserve bytes stay free
+unsigned char pool_resize(unsigned char line_num, unsigned int size, unsigned int reserve) {
+    unsigned int start = line_offset[line_num];
+    unsigned int old_size = line_offset[line_num + 1] - start;
+    unsigned int free = TEXT_POOL_SIZE - line_offset[MAX_LINES];
+    unsigned char i;
+    
+    if(size > old_size && (free < reserve || size - old_size > free - reserve)) {
+        return 0;
+    }
+    
+    // Shift the following lines to fit the new size
+    memmove(text_pool + start + size, text_pool + start + old_size,
+            line_offset[MAX_LINES] - start - old_size);
+    for(i = line_num + 1; i <= MAX_LINES; i++) {
+        line_offset[i] = line_offset[i] + size - old_size;
+    }
+    return 1;
+}
+
+unsigned char pool_store(unsigned char line_num, const char *text, unsigned int reserve) {
+    unsigned int size = encode_line(text, NULL);
+    
+    if(!pool_resize(line_num, size, reserve)) return 0;
+    encode_line(text, text_pool + line_offset[line_num]);
+    return 1;
+}
+
+// Returns the text of a line, valid until the next call
+char *doc_line(unsigned char line_num) {
+    if(line_num == edit_line_num) {
+        return edit_line;
+    }
+    decode_line(line_num, line_scratch);
+    return line_scratch;
+}
+
+// Moves a line into the expanded edit buffer and returns it, or NULL if
+// the current edit line could not be packed
+char *doc_edit(unsigned char line_num) {
+    if(line_num != edit_line_num) {
+        // Free the target line first so its space is available
+        decode_line(line_num, line_scratch);
+        pool_resize(line_num, 0, 0);
+        if(!pool_store(edit_line_num, edit_line, 0)) {
+            // Put the target line back where its bytes just came from
+            pool_store(line_num, line_scratch, 0);
+            return NULL;
+        }
+        strcpy(edit_line, line_scratch);
+        edit_line_num = line_num;
+    }
+    return edit_line;
+}
+
+unsigned char doc_store(unsigned char line_num, const char *text) {
+    if(line_num == cursor_spans_line) {
+        cursor_spans_line = 0xFF;
+    }
+    if(line_num == edit_line_num) {
+        if(encode_line(text, NULL) > TEXT_POOL_SIZE - line_offset[MAX_LINES]) return 0;
+        strcpy(edit_line, text);
+        return 1;
+    }
+    // Other lines must leave room for the edit line to be packed
+    return pool_store(line_num, text, encode_line(edit_line, NULL));
+}
+
+// Checks that the edit line can be cut to len - 1 characters plus one
+// more and still be packed
+unsigned char doc_room(unsigned char len) {
+    unsigned int free = TEXT_POOL_SIZE - line_offset[MAX_LINES];
+    
+    // Only measure when the pool is nearly full. A cut line never packs
+    // larger and one character adds at most 2 bytes.
+    return free >= len * 2 || free >= encode_line(edit_line, NULL) + 2;
+}
+
+unsigned char read_document(FILE *fp) {
+    unsigned char i = 0;
+    unsigned char len;
+    int c;
+    
+    doc_clear();
+    while(i < MAX_LINES && fgets(line_scratch, MAX_LINE_LENGTH, fp)) {
+        // Remove newline if present
+        len = strlen(line_scratch);
+        if(len > 0 && line_scratch[len-1] == '\n') {
+            line_scratch[len-1] = '\0';
+        }
+        else if(len == MAX_LINE_LENGTH - 1) {
+            // A full buffer may stop right before the newline. Longer
+            // lines continue on the next line.
+            c = fgetc(fp);
+            if(c == EOF) {
+                doc_open_end = 1;
+            }
+            else if(c != '\n') {
+                ungetc(c, fp);
+                doc_altered = 1;
+            }
+        }
+        else {
+            doc_open_end = 1;
+        }
+        if(!doc_store(i, line_scratch)) {
+            doc_altered = 1;
+            return 0;  // Out of memory
+        }
+        i++;
+        doc_lines = i;
+    }
+    
+    // Lines past the last one the editor holds are dropped
+    if(i == MAX_LINES && fgetc(fp) != EOF) {
+        doc_altered = 1;
+    }
+    return 1;
+}
+
 void draw_header(void) {
     unsigned char center_pos;
     
@@ -83,7 +471,7 @@ void init_screen(void) {
     
     // Clear screen and buffer
     clrscr();
-    memset(screen_buffer, 0, sizeof(screen_buffer));
+    doc_init();
     
     // Enable cursor and update VDC pointer
     cursor(1);
@@ -100,111 +488,31 @@ void init_screen(void) {
 }
 
 void format_current_line(void) {
-    char *line = screen_buffer[cursor_y];
-    unsigned char i = 0;
-    
-    gotoxy(0, cursor_y + HEADER_LINES + 1);
-    
-    while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-        if(line[i] == '*' && line[i+1] == '*') {
-            textcolor(MD_BOLD_COLOR);
-            cputc('*'); cputc('*');
-            i += 2;
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                if(line[i] == '*' && line[i+1] == '*') {
-                    cputc('*'); cputc('*');
-                    textcolor(MD_NORMAL_COLOR);
-                    i += 2;
-                    break;
-                }
-                cputc(line[i++]);
-            }
-        }
-        else if(line[i] == '*') {
-            textcolor(MD_ITALIC_COLOR);
-            cputc('*');
-            i++;
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                if(line[i] == '*') {
-                    cputc('*');
-                    textcolor(MD_NORMAL_COLOR);
-                    i++;
-                    break;
-                }
-                cputc(line[i++]);
-            }
-        }
-        else if(line[i] == '\'') {
-            textcolor(MD_MONO_COLOR);
-            cputc('\'');
-            i++;
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                if(line[i] == '\'') {
-                    cputc('\'');
-                    textcolor(MD_NORMAL_COLOR);
-                    i++;
-                    break;
-                }
-                textcolor(MD_MONO_COLOR);
-                cputc(line[i++]);
-            }
-        }
-        else if(line[i] == '#' && line[i+1] == '#' && (i == 0 || line[i-1] == ' ')) {
-            textcolor(MD_HEADER2_COLOR);
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                cputc(line[i++]);
-            }
-        }
-        else if(line[i] == '#' && (i == 0 || line[i-1] == ' ')) {
-            textcolor(MD_HEADER_COLOR);
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                cputc(line[i++]);
-            }
-        }
-        else {
-            textcolor(MD_NORMAL_COLOR);
-            cputc(line[i++]);
-        }
-    }
-    
-    // Clear to end of line
-    cclear(MAX_LINE_LENGTH - strlen(line));
+    draw_cursor_line();
     
     // Position cursor for next input
-    gotoxy(cursor_x, cursor_y + HEADER_LINES + 1);
+    gotoxy(cursor_x - scroll_x, cursor_y + HEADER_LINES + 1);
 }
 
-void wrap_line(unsigned char line_num) {
-    char *current_line = screen_buffer[line_num];
-    char *next_line;
-    unsigned char i, last_space = 0;
-    
-    // If we're at the last line or line is short enough, return
-    if(line_num >= MAX_LINES - 1 || strlen(current_line) < MAX_LINE_LENGTH - 1) {
-        return;
-    }
+void draw_cursor_line(void) {
+    char *line = doc_line(cursor_y);
     
-    // Find last space before width limit
-    for(i = 0; i < MAX_LINE_LENGTH - 1; i++) {
-        if(current_line[i] == ' ') {
-            last_space = i;
-        }
+    // Pan the line so the cursor stays in view
+    if(cursor_x < scroll_x) {
+        scroll_x = (cursor_x > PAN_STEP) ? cursor_x - PAN_STEP : 0;
     }
-    
-    // If no space found, force wrap at width limit
-    if(last_space == 0) {
-        last_space = MAX_LINE_LENGTH - 1;
+    else if(cursor_x >= scroll_x + VISIBLE_COLUMNS) {
+        scroll_x = cursor_x - (VISIBLE_COLUMNS - PAN_STEP);
     }
     
-    // Move remaining lines down
-    for(i = MAX_LINES - 1; i > line_num + 1; i--) {
-        strcpy(screen_buffer[i], screen_buffer[i-1]);
+    // Spans are only rebuilt when the line changes or pans, not for
+    // cursor moves
+    if(cursor_spans_line != cursor_y || cursor_spans_col != scroll_x) {
+        markdown_spans(line, &cursor_spans, scroll_x);
+        cursor_spans_line = cursor_y;
+        cursor_spans_col = scroll_x;
     }
-    
-    // Move wrapped content to next line
-    next_line = screen_buffer[line_num + 1];
-    strcpy(next_line, &current_line[last_space + 1]);
-    current_line[last_space] = '\0';
+    draw_spans(line, &cursor_spans, cursor_y + HEADER_LINES + 1, scroll_x);
 }
 
 unsigned char get_key(void) {
@@ -227,14 +535,33 @@ void handle_input(void) {
     char key;
     char *current_line;
     unsigned char shift;
+    unsigned char old_y;
+    
+    // Use idle time before the next key for background work
+    run_idle_tasks();
     
     key = cgetc();
-    current_line = screen_buffer[cursor_y];
+    last_key_jiffy = PEEK(JIFFY_CLOCK_LO);
+    current_line = doc_edit(cursor_y);
+    if(current_line == NULL) {
+        // No room to pack the edit line, so stay on it
+        cursor_y = edit_line_num;
+        current_line = edit_line;
+        if(cursor_x > strlen(current_line)) {
+            cursor_x = strlen(current_line);
+        }
+    }
     shift = PEEK(211);
+    old_y = cursor_y;
     
     // Hide cursor before processing
     cursor(0);
     
+    // Function keys use the drive, so finish with the journal first
+    if(key >= CH_F1 && key <= CH_F8) {
+        journal_close();
+    }
+    
     switch(key) {
         case CH_ENTER:
             if(cursor_y < MAX_LINES - 1) {
@@ -247,11 +574,17 @@ void handle_input(void) {
             if(cursor_x > 0) {
                 cursor_x--;
                 current_line[cursor_x] = '\0';
+                cursor_spans_line = 0xFF;
+                journal_mark(cursor_y);
             }
             else if(cursor_y > 0) {  // At start of line and not first line
                 // Move to end of previous line
+                current_line = doc_edit(cursor_y - 1);
+                if(current_line == NULL) {
+                    current_line = edit_line;
+                    break;
+                }
                 cursor_y--;
-                current_line = screen_buffer[cursor_y];
                 cursor_x = strlen(current_line);
                 
                 // Only delete if we won't exceed line length
@@ -281,20 +614,30 @@ void handle_input(void) {
             save_file();
             break;
             
+        case CH_F2:  // F2 to export
+            export_file();
+            break;
+            
         case CH_F3:  // F3 to load
             load_file();
             break;
             
+        case CH_F4:  // F4 to view a large file
+            view_file();
+            break;
+            
         case CH_F5:  // F5 for new file
             new_file();
             break;
             
         default:
-            if(cursor_x < MAX_LINE_LENGTH - 1) {
+            if(cursor_x < MAX_LINE_LENGTH - 1 && doc_room(cursor_x + 1)) {
                 // Just store whatever character we get
                 current_line[cursor_x] = key;
                 cursor_x++;
                 current_line[cursor_x] = '\0';
+                cursor_spans_line = 0xFF;
+                journal_mark(cursor_y);
             }
             break;
     }
@@ -304,11 +647,17 @@ void handle_input(void) {
         cursor_y = MAX_LINES - 1;
     }
     
+    // A panned line is shown from its start again once the cursor leaves it
+    if(cursor_y != old_y && scroll_x > 0) {
+        scroll_x = 0;
+        draw_markdown_line(doc_line(old_y), old_y + HEADER_LINES + 1);
+    }
+    
     format_current_line();
     draw_status_line();
     
     // Position cursor and show it only in editing area
-    gotoxy(cursor_x, cursor_y + HEADER_LINES + 1);
+    gotoxy(cursor_x - scroll_x, cursor_y + HEADER_LINES + 1);
     cursor(1);
 }
 
@@ -326,8 +675,8 @@ void draw_status_line(void) {
     cursor(0);  // Hide cursor while drawing status
     gotoxy(0, STATUS_LINE);
     textcolor(MD_HEADER_COLOR);
-    cputs("F1:Save  F3:Load  F5:New  F7:Help         Line:");
-    cprintf(" %d/%d", cursor_y + 1, MAX_LINES);
+    cputs("F1:Save  F2:Export  F3:Load  F4:View  F5:New  F7:Help  Line:");
+    cprintf(" %d/%d Col: %d  ", cursor_y + 1, MAX_LINES, cursor_x + 1);
     // Don't re-enable cursor here
 }
 
@@ -368,19 +717,9 @@ void draw_dialog(const char *title, unsigned char width, unsigned char height) {
     textcolor(old_color);
 }
 
-void save_file(void) {
-    unsigned char i;
-    FILE *fp;
-    char filename[17] = "md.txt";
+void input_filename(char *filename, unsigned char start_x, unsigned char start_y) {
     char c;
     unsigned char pos = 0;
-    unsigned char dialog_width = 40;
-    unsigned char dialog_height = 5;
-    unsigned char start_x = (SCREEN_WIDTH - dialog_width) / 2;
-    unsigned char start_y = (25 - dialog_height) / 2;
-    
-    // Draw save dialog
-    draw_dialog("Save File", dialog_width, dialog_height);
     
     // Show input prompt
     gotoxy(start_x + 2, start_y + 2);
@@ -408,6 +747,63 @@ void save_file(void) {
         }
     }
     cursor(0);  // Hide cursor after input
+}
+
+// Returns the number of lines to write, empty lines are kept up to the
+// last text line, the cursor or the end of the loaded file
+unsigned char doc_length(void) {
+    unsigned char i;
+    unsigned char last = (cursor_y > doc_lines) ? cursor_y : doc_lines;
+    
+    for(i = 0; i < MAX_LINES; i++) {
+        if(doc_line(i)[0] != '\0' && i >= last) {
+            last = i + 1;
+        }
+    }
+    return last;
+}
+
+// Checks whether a written line ends with a newline, a file that had
+// none after its last line gets none back
+unsigned char doc_newline(unsigned char line_num, unsigned char last) {
+    return !(doc_open_end && line_num == last - 1 && last == doc_lines);
+}
+
+void write_document(FILE *fp) {
+    unsigned char i;
+    unsigned char last = doc_length();
+    
+    // Write each line to file
+    for(i = 0; i < last; i++) {
+        fputs(doc_line(i), fp);
+        if(doc_newline(i, last)) {
+            fputc('\n', fp);
+        }
+    }
+}
+
+void save_file(void) {
+    FILE *fp;
+    char filename[17] = "md.txt";
+    unsigned char dialog_width = 40;
+    unsigned char dialog_height = 5;
+    unsigned char start_x = (SCREEN_WIDTH - dialog_width) / 2;
+    unsigned char start_y = (25 - dialog_height) / 2;
+    
+    // Draw save dialog
+    draw_dialog("Save File", dialog_width, dialog_height);
+    input_filename(filename, start_x, start_y);
+    
+    // Writing back a split or truncated document would lose the original
+    if(doc_altered && strcmp(filename, current_filename) == 0) {
+        draw_dialog("Error", dialog_width, dialog_height);
+        gotoxy(start_x + 2, start_y + 2);
+        textcolor(2);  // Red
+        cputs("File was altered, use a new name!");
+        cgetc();  // Wait for key
+        draw_status_line();
+        return;
+    }
     
     // Open file for writing
     fp = fopen(filename, "w");
@@ -421,18 +817,14 @@ void save_file(void) {
         return;
     }
     
-    // Write each line to file
-    for(i = 0; i < MAX_LINES; i++) {
-        if(screen_buffer[i][0] != '\0') {
-            fprintf(fp, "%s\n", screen_buffer[i]);
-        } else if(i < cursor_y) {
-            // Write empty line if there was a newline here
-            fprintf(fp, "\n");
-        }
-    }
-    
+    write_document(fp);
     fclose(fp);
     
+    // The file now holds everything, start a fresh journal
+    strcpy(current_filename, filename);
+    file_saved = 1;
+    journal_reset();
+    
     // Show success dialog
     draw_dialog("Success", dialog_width, dialog_height);
     gotoxy(start_x + 2, start_y + 2);
@@ -445,33 +837,14 @@ void save_file(void) {
     // Reload the file to ensure consistency
     fp = fopen(filename, "r");
     if(fp != NULL) {
-        // Clear current buffer
-        memset(screen_buffer, 0, sizeof(screen_buffer));
         cursor_x = cursor_y = 0;
         
         // Read file into buffer
-        i = 0;
-        while(i < MAX_LINES && fgets(screen_buffer[i], MAX_LINE_LENGTH, fp)) {
-            // Remove newline if present
-            unsigned char len = strlen(screen_buffer[i]);
-            if(len > 0 && screen_buffer[i][len-1] == '\n') {
-                screen_buffer[i][len-1] = '\0';
-            }
-            i++;
-        }
+        read_document(fp);
         fclose(fp);
         
         // Redraw screen
-        clrscr();
-        draw_header();
-        for(i = 0; i < MAX_LINES; i++) {
-            if(screen_buffer[i][0] != '\0' || i < cursor_y) {
-                cursor_y = i;
-                format_current_line();
-            }
-        }
-        cursor_y = 0;
-        draw_status_line();
+        redraw_screen();
     }
 }
 
@@ -512,24 +885,27 @@ void draw_file_list(struct file_entry *files, unsigned char file_count, unsigned
 
 void apply_formatting(void) {
     unsigned char i;
+    char *line;
     cursor(0);  // Hide cursor during formatting
     
     // First pass: load plain text
     for(i = 0; i < MAX_LINES; i++) {
-        if(screen_buffer[i][0] != '\0') {
-            revers(0);
-            textcolor(MD_NORMAL_COLOR);
-            gotoxy(0, i + HEADER_LINES + 1);
-            cputs(screen_buffer[i]);
-            cclear(MAX_LINE_LENGTH - strlen(screen_buffer[i]));
+        line = doc_line(i);
+        if(line[0] != '\0') {
+            // A single span in the normal color
+            work_spans.count = 1;
+            work_spans.end[0] = strlen(line);
+            work_spans.color[0] = MD_NORMAL_COLOR;
+            draw_spans(line, &work_spans, i + HEADER_LINES + 1, 0);
         }
     }
     
     // Second pass: apply formatting
     for(i = 0; i < MAX_LINES; i++) {
-        if(screen_buffer[i][0] != '\0') {
+        line = doc_line(i);
+        if(line[0] != '\0') {
             cursor_y = i;
-            cursor_x = strlen(screen_buffer[i]);  // Move to end of line
+            cursor_x = strlen(line);  // Move to end of line
             format_current_line();
         }
     }
@@ -537,86 +913,121 @@ void apply_formatting(void) {
     // Position cursor at end of text
     cursor_y = 0;
     for(i = 0; i < MAX_LINES; i++) {
-        if(screen_buffer[i][0] != '\0') {
+        if(doc_line(i)[0] != '\0') {
             cursor_y = i;
         }
     }
-    cursor_x = strlen(screen_buffer[cursor_y]);
-    gotoxy(cursor_x, cursor_y + HEADER_LINES + 1);
+    cursor_x = strlen(doc_line(cursor_y));
+    gotoxy(cursor_x - scroll_x, cursor_y + HEADER_LINES + 1);
     cursor(1);  // Show cursor again
 }
 
 void format_line_without_cursor(unsigned char line_num) {
-    char *line = screen_buffer[line_num];
+    // The cursor line may be panned
+    if(line_num == cursor_y) {
+        draw_cursor_line();
+        return;
+    }
+    draw_markdown_line(doc_line(line_num), line_num + HEADER_LINES + 1);
+}
+
+void draw_markdown_line(const char *line, unsigned char row) {
+    markdown_spans(line, &work_spans, 0);
+    draw_spans(line, &work_spans, row, 0);
+}
+
+void add_span(struct line_spans *spans, unsigned char end, unsigned char color) {
+    // Extend the last span when the color does not change or no slot is left
+    if(spans->count > 0 &&
+       (spans->color[spans->count - 1] == color || spans->count == MAX_SPANS)) {
+        spans->end[spans->count - 1] = end;
+        return;
+    }
+    spans->end[spans->count] = end;
+    spans->color[spans->count] = color;
+    spans->count++;
+}
+
+// Builds the spans of the columns visible from first_col on
+void markdown_spans(const char *line, struct line_spans *spans, unsigned char first_col) {
     unsigned char i = 0;
+    unsigned char color;
+    unsigned int last_col = first_col + VISIBLE_COLUMNS;
     
-    gotoxy(0, line_num + HEADER_LINES + 1);
-    revers(0);  // Ensure reverse is off
-    
-    while(i < MAX_LINE_LENGTH && line[i] != '\0') {
+    spans->count = 0;
+    while(line[i] != '\0' && i < last_col) {
         if(line[i] == '*' && line[i+1] == '*') {
-            textcolor(MD_BOLD_COLOR);
-            cputc('*'); cputc('*');
+            color = MD_BOLD_COLOR;
             i += 2;
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
+            while(line[i] != '\0') {
                 if(line[i] == '*' && line[i+1] == '*') {
-                    cputc('*'); cputc('*');
-                    textcolor(MD_NORMAL_COLOR);
                     i += 2;
                     break;
                 }
-                cputc(line[i++]);
+                i++;
             }
         }
         else if(line[i] == '*') {
-            textcolor(MD_ITALIC_COLOR);
-            cputc('*');
+            color = MD_ITALIC_COLOR;
             i++;
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                if(line[i] == '*') {
-                    cputc('*');
-                    textcolor(MD_NORMAL_COLOR);
-                    i++;
-                    break;
-                }
-                cputc(line[i++]);
+            while(line[i] != '\0') {
+                if(line[i++] == '*') break;
             }
         }
         else if(line[i] == '\'') {
-            textcolor(MD_MONO_COLOR);
-            cputc('\'');
+            color = MD_MONO_COLOR;
             i++;
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                if(line[i] == '\'') {
-                    cputc('\'');
-                    textcolor(MD_NORMAL_COLOR);
-                    i++;
-                    break;
-                }
-                textcolor(MD_MONO_COLOR);
-                cputc(line[i++]);
-            }
-        }
-        else if(line[i] == '#' && line[i+1] == '#' && (i == 0 || line[i-1] == ' ')) {
-            textcolor(MD_HEADER2_COLOR);
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                cputc(line[i++]);
+            while(line[i] != '\0') {
+                if(line[i++] == '\'') break;
             }
         }
         else if(line[i] == '#' && (i == 0 || line[i-1] == ' ')) {
-            textcolor(MD_HEADER_COLOR);
-            while(i < MAX_LINE_LENGTH && line[i] != '\0') {
-                cputc(line[i++]);
-            }
+            // Headers run to the end of the line
+            color = (line[i+1] == '#') ? MD_HEADER2_COLOR : MD_HEADER_COLOR;
+            i += strlen(line + i);
         }
         else {
-            textcolor(MD_NORMAL_COLOR);
-            cputc(line[i++]);
+            color = MD_NORMAL_COLOR;
+            i++;
+        }
+        
+        // Runs left of the window are parsed but not kept
+        if(i > first_col) {
+            add_span(spans, i, color);
+        }
+    }
+}
+
+// Draws the visible slice of a line starting at first_col
+void draw_spans(const char *line, const struct line_spans *spans, unsigned char row, unsigned char first_col) {
+    unsigned char s = 0;
+    unsigned int x = first_col;
+    unsigned int end = first_col + VISIBLE_COLUMNS;
+    unsigned int len = strlen(line);
+    
+    gotoxy(0, row);
+    revers(0);  // Ensure reverse is off
+    
+    if(end > len) end = len;
+    while(s < spans->count && spans->end[s] <= x) s++;
+    
+    while(x < end) {
+        textcolor(spans->color[s]);
+        while(x < end && x < spans->end[s]) {
+            cputc(line[x++]);
         }
+        s++;
     }
     
     // Clear to end of line
-    cclear(MAX_LINE_LENGTH - strlen(line));
+    x = (x > first_col) ? x - first_col : 0;
+    if(x < VISIBLE_COLUMNS) {
+        cclear(VISIBLE_COLUMNS - x);
+    }
+    
+    // The spare last column shows that the line goes on past the screen
+    textcolor(MD_HEADER_COLOR);
+    cputc(len > first_col + VISIBLE_COLUMNS ? MORE_MARKER : ' ');
 }
 
 void load_file(void) {
@@ -625,7 +1036,6 @@ void load_file(void) {
     unsigned char selected = 0;
     char c;
     FILE *fp;
-    unsigned char i;
     unsigned char dialog_width = 40;
     unsigned char dialog_height = 15;
     unsigned char start_x = (SCREEN_WIDTH - dialog_width) / 2;
@@ -693,28 +1103,32 @@ void load_file(void) {
                 }
                 
                 // Read file into buffer
-                i = 0;
-                while(i < MAX_LINES && fgets(screen_buffer[i], MAX_LINE_LENGTH, fp)) {
-                    // Remove newline if present
-                    unsigned char len = strlen(screen_buffer[i]);
-                    if(len > 0 && screen_buffer[i][len-1] == '\n') {
-                        screen_buffer[i][len-1] = '\0';
-                    }
-                    i++;
+                if(!read_document(fp)) {
+                    draw_dialog("Error", dialog_width, 5);
+                    gotoxy(start_x + 2, start_y + 2);
+                    textcolor(2);
+                    cputs("Out of memory, file truncated!");
+                    cgetc();
+                }
+                else if(doc_altered) {
+                    draw_dialog("Warning", dialog_width, 5);
+                    gotoxy(start_x + 2, start_y + 2);
+                    textcolor(2);
+                    cputs("File did not fit, text split or cut!");
+                    cgetc();
                 }
                 fclose(fp);
+                strcpy(current_filename, files[selected].name);
+                file_saved = 0;
+                journal_reset();
                 
                 // Clear screen and redraw without cursor
                 cursor(0);  // Hide cursor during redraw
                 clrscr();
                 draw_header();
                 
-                // Format all lines without cursor
-                for(i = 0; i < MAX_LINES; i++) {
-                    if(screen_buffer[i][0] != '\0') {
-                        format_line_without_cursor(i);
-                    }
-                }
+                // Lines are formatted in the background
+                queue_repaint_all();
                 
                 // Now position cursor and show it
                 cursor_x = 0;
@@ -733,7 +1147,6 @@ void load_file(void) {
 }
 
 void new_file(void) {
-    unsigned char i;
     unsigned char dialog_width = 40;
     unsigned char dialog_height = 5;
     unsigned char start_x = (SCREEN_WIDTH - dialog_width) / 2;
@@ -750,20 +1163,15 @@ void new_file(void) {
     c = cgetc();
     if(c != 'y' && c != 'Y') {
         // Redraw screen and return
-        clrscr();
-        draw_header();
-        for(i = 0; i < MAX_LINES; i++) {
-            if(screen_buffer[i][0] != '\0') {
-                cursor_y = i;
-                format_current_line();
-            }
-        }
-        draw_status_line();
+        redraw_screen();
         return;
     }
     
     // Clear buffer
-    memset(screen_buffer, 0, sizeof(screen_buffer));
+    doc_clear();
+    current_filename[0] = '\0';
+    file_saved = 0;
+    journal_reset();
     
     // Reset screen
     clrscr();
@@ -776,8 +1184,985 @@ void new_file(void) {
     gotoxy(0, HEADER_LINES + 1);
 }
 
+void redraw_screen(void) {
+    cursor(0);
+    clrscr();
+    draw_header();
+    
+    // The cursor line is drawn now, the rest when the keyboard is idle
+    queue_repaint_all();
+    line_stale[cursor_y] = 0;
+    format_line_without_cursor(cursor_y);
+    draw_status_line();
+    gotoxy(cursor_x - scroll_x, cursor_y + HEADER_LINES + 1);
+}
+
+unsigned char petscii_to_ascii(unsigned char c) {
+    if(c == '\n') return 0x0A;
+    if(c >= 0x41 && c <= 0x5A) return c + 0x20;  // Lowercase letters
+    if(c >= 0x61 && c <= 0x7A) return c - 0x20;  // Uppercase letters
+    if(c >= 0xC1 && c <= 0xDA) return c - 0x80;  // Shifted uppercase letters
+    return c;
+}
+
+void export_flush(void) {
+    if(export_len > 0) {
+        // An absent printer only shows up here, the open never touches the bus
+        if(cbm_write(EXPORT_LFN, export_buf, export_len) != export_len) {
+            export_error = 1;
+        }
+        export_len = 0;
+    }
+}
+
+void export_putc(char c) {
+    if(export_html) {
+        c = petscii_to_ascii(c);
+    }
+    export_buf[export_len++] = c;
+    if(export_len == EXPORT_BUF_SIZE) {
+        export_flush();
+    }
+}
+
+void export_puts(const char *s) {
+    while(*s != '\0') {
+        export_putc(*s++);
+    }
+}
+
+void export_text(char c) {
+    if(export_html) {
+        if(c == '<') { export_puts("&lt;"); return; }
+        if(c == '>') { export_puts("&gt;"); return; }
+        if(c == '&') { export_puts("&amp;"); return; }
+    }
+    export_putc(c);
+}
+
+void export_span(unsigned char span, unsigned char closing) {
+    static const char *const tags[] = { "", "strong>", "em>", "code>" };
+    
+    // The printer gets plain text, markers are simply dropped
+    if(!export_html || span == SPAN_NONE) return;
+    export_puts(closing ? "</" : "<");
+    export_puts(tags[span]);
+}
+
+// Returns 1 if the line was a heading, so paragraphs can be closed
+unsigned char export_line(const char *line, unsigned char in_para) {
+    unsigned char i = 0;
+    unsigned char level = 0;
+    unsigned char span = SPAN_NONE;
+    unsigned char count = 0;
+    
+    // Headings: # is H1, ## (or deeper) is H2, like the highlighter
+    while(line[i] == '#') {
+        level++;
+        i++;
+    }
+    if(level > 2) level = 2;
+    if(level > 0) {
+        while(line[i] == ' ') i++;
+        if(export_html) {
+            if(in_para) export_puts("</p>\n");
+            export_puts(level == 1 ? "<h1>" : "<h2>");
+        }
+    }
+    else if(export_html) {
+        export_puts(in_para ? "\n" : "<p>");
+    }
+    
+    // Inline spans follow the same rules as format_current_line()
+    while(line[i] != '\0') {
+        if(span == SPAN_NONE) {
+            if(line[i] == '*' && line[i+1] == '*') {
+                span = SPAN_BOLD;
+                i += 2;
+                export_span(span, 0);
+                continue;
+            }
+            else if(line[i] == '*') {
+                span = SPAN_ITALIC;
+                i++;
+                export_span(span, 0);
+                continue;
+            }
+            else if(line[i] == '\'') {
+                span = SPAN_MONO;
+                i++;
+                export_span(span, 0);
+                continue;
+            }
+        }
+        else if((span == SPAN_BOLD && line[i] == '*' && line[i+1] == '*') ||
+                (span == SPAN_ITALIC && line[i] == '*') ||
+                (span == SPAN_MONO && line[i] == '\'')) {
+            i += (span == SPAN_BOLD) ? 2 : 1;
+            export_span(span, 1);
+            span = SPAN_NONE;
+            continue;
+        }
+        export_text(line[i++]);
+        count++;
+    }
+    
+    // Unterminated spans end with the line
+    export_span(span, 1);
+    
+    if(level > 0) {
+        if(export_html) {
+            export_puts(level == 1 ? "</h1>\n" : "</h2>\n");
+        }
+        else {
+            // Underline headings on the printer
+            export_putc('\n');
+            while(count-- > 0) {
+                export_putc(level == 1 ? '=' : '-');
+            }
+            export_putc('\n');
+        }
+        return 1;
+    }
+    
+    if(!export_html) {
+        export_putc('\n');
+    }
+    return 0;
+}
+
+void export_file(void) {
+    unsigned char i;
+    unsigned char last = 0;
+    unsigned char in_para = 0;
+    unsigned char result;
+    char c;
+    char *line;
+    char filename[17] = "md.htm";
+    char open_name[24];
+    unsigned char dialog_width = 40;
+    unsigned char dialog_height = 5;
+    unsigned char start_x = (SCREEN_WIDTH - dialog_width) / 2;
+    unsigned char start_y = (25 - dialog_height) / 2;
+    
+    // Ask for the destination
+    draw_dialog("Export", dialog_width, dialog_height);
+    gotoxy(start_x + 2, start_y + 2);
+    textcolor(MD_NORMAL_COLOR);
+    cputs("D)isk HTML  P)rinter  ESC)Cancel");
+    do {
+        c = cgetc();
+    } while(c != 'd' && c != 'D' && c != 'p' && c != 'P' && c != CH_ESC);
+    
+    if(c == CH_ESC) {
+        redraw_screen();
+        return;
+    }
+    
+    if(c == 'd' || c == 'D') {
+        export_html = 1;
+        draw_dialog("Export HTML", dialog_width, dialog_height);
+        input_filename(filename, start_x, start_y);
+        
+        // Replace an earlier export, the drive reports any failure on
+        // the command channel rather than to the open itself
+        strcpy(open_name, "@0:");
+        strcat(open_name, filename);
+        strcat(open_name, ",s,w");
+        result = cbm_open(DRIVE_CMD_LFN, DISK_DEVICE, 15, "");
+        if(result == 0) {
+            result = cbm_open(EXPORT_LFN, DISK_DEVICE, 2, open_name);
+        }
+        if(result == 0 && drive_status() >= DRIVE_ERROR_MIN) {
+            result = 1;
+        }
+    }
+    else {
+        export_html = 0;
+        result = cbm_open(EXPORT_LFN, PRINTER_DEVICE, PRINTER_LOWERCASE, "");
+    }
+    
+    if(result != 0) {
+        cbm_close(EXPORT_LFN);
+        cbm_close(DRIVE_CMD_LFN);
+        draw_dialog("Error", dialog_width, dialog_height);
+        gotoxy(start_x + 2, start_y + 2);
+        textcolor(2);  // Red
+        cputs(export_html ? "Could not create file!" : "Printer not ready!");
+        cgetc();
+        redraw_screen();
+        return;
+    }
+    
+    // Find the last line with text, trailing empty lines are not exported
+    for(i = 0; i < MAX_LINES; i++) {
+        if(doc_line(i)[0] != '\0') {
+            last = i + 1;
+        }
+    }
+    
+    // Stream the document straight from the buffer in a single pass
+    export_len = 0;
+    export_error = 0;
+    if(export_html) {
+        export_puts("<html><body>\n");
+    }
+    for(i = 0; i < last && !export_error; i++) {
+        line = doc_line(i);
+        gotoxy(0, STATUS_LINE);
+        textcolor(MD_HEADER_COLOR);
+        cprintf("Exporting line %d/%d", i + 1, last);
+        cclear(SCREEN_WIDTH - 1 - wherex());
+        
+        if(line[0] == '\0') {
+            // Empty lines end paragraphs
+            if(in_para && export_html) {
+                export_puts("</p>\n");
+            }
+            else if(!export_html) {
+                export_putc('\n');
+            }
+            in_para = 0;
+        }
+        else if(export_line(line, in_para)) {
+            in_para = 0;
+        }
+        else {
+            in_para = 1;
+        }
+    }
+    if(export_html) {
+        if(in_para) export_puts("</p>\n");
+        export_puts("</body></html>\n");
+    }
+    export_flush();
+    cbm_close(EXPORT_LFN);
+    
+    // Errors such as a full disk are reported when the file is closed
+    if(export_html) {
+        if(drive_status() >= DRIVE_ERROR_MIN) {
+            export_error = 1;
+        }
+        cbm_close(DRIVE_CMD_LFN);
+    }
+    
+    if(export_error) {
+        draw_dialog("Error", dialog_width, dialog_height);
+        gotoxy(start_x + 2, start_y + 2);
+        textcolor(2);  // Red
+        cputs(export_html ? "Write error, export incomplete!" : "Printer not ready!");
+        cgetc();
+        redraw_screen();
+        return;
+    }
+    
+    // Show success dialog
+    draw_dialog("Success", dialog_width, dialog_height);
+    gotoxy(start_x + 2, start_y + 2);
+    textcolor(5);  // Green
+    cprintf("Exported %d lines", last);
+    cgetc();
+    redraw_screen();
+}
+
+// Reads the status of the last drive command, returns its error number
+unsigned char drive_status(void) {
+    char status[40];
+    
+    if(cbm_read(DRIVE_CMD_LFN, status, sizeof(status)) < 2) {
+        return 0xFF;
+    }
+    return (status[0] - '0') * 10 + (status[1] - '0');
+}
+
+void view_read_block(unsigned char track, unsigned char sector) {
+    char cmd[16];
+    
+    // Block-read the sector into the drive buffer, then fetch it
+    sprintf(cmd, "u1 %d 0 %d %d", VIEW_DATA_LFN, track, sector);
+    cbm_write(DRIVE_CMD_LFN, cmd, strlen(cmd));
+    if(drive_status() >= DRIVE_ERROR_MIN) {
+        // Treat the block as the empty end of the file, never follow its link
+        view_error = 1;
+        view_block[0] = 0;
+        view_block[1] = 1;
+    }
+    else {
+        cbm_read(VIEW_DATA_LFN, view_block, 256);
+    }
+    
+    view_track = track;
+    view_sector = sector;
+    view_pos = 2;
+    // Bytes 0/1 link to the next block, or hold the last used byte at the end
+    view_end = (view_block[0] == 0) ? view_block[1] : 255;
+}
+
+unsigned char view_at_eof(void) {
+    if(view_pos > view_end) {
+        if(view_block[0] == 0) return 1;
+        view_read_block(view_block[0], view_block[1]);
+    }
+    return 0;
+}
+
+// Reads one line into buf, returns 0 when the file has ended
+unsigned char view_read_line(char *buf) {
+    unsigned char len = 0;
+    char c;
+    
+    buf[0] = '\0';
+    if(view_at_eof()) return 0;
+    
+    while(!view_at_eof()) {
+        c = view_block[view_pos++];
+        if(c == '\n') break;
+        // Lines wider than the screen are cut off
+        if(len < VIEW_LINE_LENGTH - 1) {
+            buf[len++] = c;
+        }
+    }
+    buf[len] = '\0';
+    view_next_line++;
+    return 1;
+}
+
+unsigned char view_find_file(const char *filename) {
+    unsigned char i, j;
+    unsigned char blocks = 0;
+    unsigned char *entry;
+    
+    // The directory chain starts from the link in the BAM block. It never
+    // leaves the directory track, so stop after one pass over that track.
+    view_read_block(DIR_TRACK, 0);
+    while(view_block[0] == DIR_TRACK && blocks++ < DIR_SECTORS && !view_error) {
+        view_read_block(DIR_TRACK, view_block[1]);
+        for(i = 0; i < 8; i++) {
+            entry = view_block + i * 32;
+            // Only closed SEQ and PRG files
+            if(entry[2] != 0x81 && entry[2] != 0x82) continue;
+            for(j = 0; j < 16 && filename[j] != '\0'; j++) {
+                if(entry[5 + j] != (unsigned char)filename[j]) break;
+            }
+            if(filename[j] == '\0' && (j == 16 || entry[5 + j] == 0xA0)) {
+                view_read_block(entry[3], entry[4]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void view_build_index(void) {
+    unsigned char i;
+    char c;
+    
+    view_mark_count = 0;
+    view_stride = 8;
+    view_total_lines = 0;
+    
+    // Single streaming pass, noting where every view_stride-th line starts
+    while(!view_at_eof()) {
+        if(view_total_lines % view_stride == 0) {
+            if(view_mark_count == VIEW_MARKS) {
+                // Index is full: keep every other mark and double the stride
+                for(i = 0; i < VIEW_MARKS / 2; i++) {
+                    view_marks[i] = view_marks[i * 2];
+                }
+                view_mark_count = VIEW_MARKS / 2;
+                view_stride *= 2;
+            }
+            if(view_total_lines % view_stride == 0) {
+                view_marks[view_mark_count].track = view_track;
+                view_marks[view_mark_count].sector = view_sector;
+                view_marks[view_mark_count].offset = view_pos;
+                view_marks[view_mark_count].line = view_total_lines;
+                view_mark_count++;
+            }
+        }
+        
+        // Skip to the start of the next line
+        do {
+            c = view_block[view_pos++];
+        } while(c != '\n' && !view_at_eof());
+        view_total_lines++;
+        
+        if((view_total_lines & 0x3F) == 0) {
+            gotoxy(0, STATUS_LINE);
+            textcolor(MD_HEADER_COLOR);
+            cprintf("Indexing line %u", view_total_lines);
+        }
+    }
+}
+
+void view_seek(unsigned int line) {
+    struct view_mark *mark;
+    unsigned int index = line / view_stride;
+    
+    if(index >= view_mark_count) index = view_mark_count - 1;
+    mark = &view_marks[index];
+    
+    // Position at the nearest mark, then skip the remaining lines
+    view_read_block(mark->track, mark->sector);
+    view_pos = mark->offset;
+    view_next_line = mark->line;
+    while(view_next_line < line && !view_at_eof()) {
+        if(view_block[view_pos++] == '\n') {
+            view_next_line++;
+        }
+    }
+}
+
+void view_fetch(unsigned int line, char *buf) {
+    if(line >= view_total_lines) {
+        buf[0] = '\0';
+        return;
+    }
+    if(line != view_next_line) {
+        view_seek(line);
+    }
+    view_read_line(buf);
+}
+
+void view_draw(unsigned int top) {
+    unsigned char i;
+    unsigned int last = top + VIEW_ROWS;
+    
+    for(i = 0; i < VIEW_ROWS; i++) {
+        draw_markdown_line(view_window[i], i + HEADER_LINES + 1);
+    }
+    
+    if(last > view_total_lines) last = view_total_lines;
+    gotoxy(0, STATUS_LINE);
+    textcolor(MD_HEADER_COLOR);
+    cprintf("CRSR:Scroll  CRSR L/R:Page  HOME:Top  ESC:Exit   Lines %u-%u/%u",
+            top + 1, last, view_total_lines);
+    cclear(SCREEN_WIDTH - 1 - wherex());
+}
+
+void view_file(void) {
+    unsigned char i;
+    unsigned int top = 0;
+    unsigned int target;
+    char c;
+    char filename[17] = "";
+    unsigned char dialog_width = 40;
+    unsigned char dialog_height = 5;
+    unsigned char start_x = (SCREEN_WIDTH - dialog_width) / 2;
+    unsigned char start_y = (25 - dialog_height) / 2;
+    
+    draw_dialog("View File", dialog_width, dialog_height);
+    input_filename(filename, start_x, start_y);
+    
+    view_error = 0;
+    if(cbm_open(DRIVE_CMD_LFN, DISK_DEVICE, 15, "") != 0 ||
+       cbm_open(VIEW_DATA_LFN, DISK_DEVICE, VIEW_DATA_LFN, "#") != 0 ||
+       !view_find_file(filename)) {
+        cbm_close(VIEW_DATA_LFN);
+        cbm_close(DRIVE_CMD_LFN);
+        draw_dialog("Error", dialog_width, dialog_height);
+        gotoxy(start_x + 2, start_y + 2);
+        textcolor(2);  // Red
+        cputs(view_error ? "Disk read error!" : "File not found!");
+        cgetc();
+        redraw_screen();
+        return;
+    }
+    
+    // Index the whole file once, then page from the index
+    cursor(0);
+    clrscr();
+    draw_header();
+    view_build_index();
+    if(view_error) {
+        cbm_close(VIEW_DATA_LFN);
+        cbm_close(DRIVE_CMD_LFN);
+        draw_dialog("Error", dialog_width, dialog_height);
+        gotoxy(start_x + 2, start_y + 2);
+        textcolor(2);  // Red
+        cputs("Disk read error!");
+        cgetc();
+        redraw_screen();
+        return;
+    }
+    if(view_mark_count == 0) {
+        // Empty file, don't show lines left from an earlier file
+        view_total_lines = 0;
+        memset(view_window, 0, sizeof(view_window));
+    }
+    else {
+        view_seek(0);
+        for(i = 0; i < VIEW_ROWS; i++) {
+            view_fetch(i, view_window[i]);
+        }
+    }
+    view_draw(top);
+    
+    while(1) {
+        c = cgetc();
+        target = top;
+        switch(c) {
+            case CH_CURS_DOWN:
+                if(top + VIEW_ROWS < view_total_lines) {
+                    // Scroll the window and fetch just the new bottom line
+                    memmove(view_window[0], view_window[1], (VIEW_ROWS - 1) * VIEW_LINE_LENGTH);
+                    top++;
+                    view_fetch(top + VIEW_ROWS - 1, view_window[VIEW_ROWS - 1]);
+                    view_draw(top);
+                }
+                continue;
+                
+            case CH_CURS_UP:
+                if(top > 0) {
+                    memmove(view_window[1], view_window[0], (VIEW_ROWS - 1) * VIEW_LINE_LENGTH);
+                    top--;
+                    view_fetch(top, view_window[0]);
+                    view_draw(top);
+                }
+                continue;
+                
+            case CH_CURS_RIGHT:
+                if(top + VIEW_ROWS < view_total_lines) {
+                    target = top + VIEW_ROWS;
+                }
+                break;
+                
+            case CH_CURS_LEFT:
+                target = (top > VIEW_ROWS) ? top - VIEW_ROWS : 0;
+                break;
+                
+            case CH_HOME:
+                target = 0;
+                break;
+                
+            case CH_ESC:
+                cbm_close(VIEW_DATA_LFN);
+                cbm_close(DRIVE_CMD_LFN);
+                redraw_screen();
+                return;
+        }
+        
+        // Page to a new window position
+        if(target != top) {
+            top = target;
+            for(i = 0; i < VIEW_ROWS; i++) {
+                view_fetch(top + i, view_window[i]);
+            }
+            view_draw(top);
+        }
+    }
+}
+
+void journal_mark(unsigned char line_num) {
+    line_dirty[line_num] = 1;
+    journal_pending = !journal_disabled;
+}
+
+// Starts folding the journal into the main file, but only into a file the
+// user saved this session
+void journal_compact_start(void) {
+    char open_name[24];
+    
+    strcpy(open_name, "@0:");
+    strcat(open_name, current_filename);
+    journal_fp = fopen(open_name, "w");
+    if(journal_fp == NULL) {
+        journal_records = 0;  // Try again after another batch
+        return;
+    }
+    compact_line = 0;
+    compact_last = doc_length();
+    journal_state = JOURNAL_COMPACTING;
+}
+
+// Queues the next line of the main file. Lines edited meanwhile stay
+// dirty and start a new journal.
+void journal_compact_line(void) {
+    if(compact_line == compact_last) {
+        journal_state = JOURNAL_COMPACTED;
+        return;
+    }
+    strcpy(journal_buf, doc_line(compact_line));
+    if(doc_newline(compact_line, compact_last)) {
+        strcat(journal_buf, "\n");
+    }
+    journal_len = strlen(journal_buf);
+    journal_pos = 0;
+    compact_line++;
+}
+
+// Starts rewriting the journal as one record per line, for documents
+// that may not be compacted into their file. The old journal stays until
+// the snapshot is complete.
+void journal_snapshot_start(void) {
+    journal_fp = fopen("@0:" JOURNAL_TEMP, "w");
+    if(journal_fp == NULL) {
+        journal_records = 0;  // Try again after another batch
+        return;
+    }
+    sprintf(journal_buf, "%c%s\n", JOURNAL_NAME_RECORD, current_filename);
+    journal_len = strlen(journal_buf);
+    journal_pos = 0;
+    compact_line = 0;
+    journal_state = JOURNAL_SNAPSHOT;
+}
+
+// Queues the record of the next line. Every line gets one, so the
+// snapshot also blanks lines of the main file that were cleared.
+void journal_snapshot_line(void) {
+    if(compact_line == MAX_LINES) {
+        journal_state = JOURNAL_SNAPSHOTTED;
+        return;
+    }
+    sprintf(journal_buf, "%02d%s\n", compact_line, doc_line(compact_line));
+    journal_len = strlen(journal_buf);
+    journal_pos = 0;
+    compact_line++;
+}
+
+// Opens the journal for a batch of records, the first batch creates it
+void journal_open(void) {
+    if(journal_exists) {
+        journal_fp = fopen(JOURNAL_NAME, "a");
+    }
+    else {
+        journal_fp = fopen("@0:" JOURNAL_NAME, "w");
+    }
+    if(journal_fp == NULL) {
+        journal_pending = 0;
+        return;
+    }
+    if(!journal_exists) {
+        sprintf(journal_buf, "%c%s\n", JOURNAL_NAME_RECORD, current_filename);
+        journal_len = strlen(journal_buf);
+        journal_pos = 0;
+        journal_exists = 1;
+    }
+    journal_state = JOURNAL_WRITING;
+}
+
+// Queues one record, a two digit line number and the line's text. The
+// journal is closed once no dirty lines are left.
+void journal_next_record(void) {
+    unsigned char i;
+    
+    for(i = 0; i < MAX_LINES; i++) {
+        if(line_dirty[i]) {
+            sprintf(journal_buf, "%02d%s\n", i, doc_line(i));
+            journal_len = strlen(journal_buf);
+            journal_pos = 0;
+            line_dirty[i] = 0;
+            journal_records++;
+            return;
+        }
+    }
+    journal_pending = 0;
+    journal_state = JOURNAL_CLOSING;
+}
+
+// Writes the next few bytes of the queued output
+void journal_put_chunk(void) {
+    unsigned int n = journal_len - journal_pos;
+    
+    if(n > JOURNAL_CHUNK) n = JOURNAL_CHUNK;
+    if(fwrite(journal_buf + journal_pos, 1, n, journal_fp) == n) {
+        journal_pos += n;
+        return;
+    }
+    
+    // Give up until the next edit. A main file that failed half way is
+    // not compacted into again, the journal still holds its edits.
+    fclose(journal_fp);
+    journal_len = journal_pos = 0;
+    if(journal_state == JOURNAL_COMPACTING) {
+        file_saved = 0;
+    }
+    else if(journal_state == JOURNAL_SNAPSHOT) {
+        remove(JOURNAL_TEMP);
+        journal_records = 0;
+    }
+    journal_pending = 0;
+    journal_state = JOURNAL_IDLE;
+}
+
+// Does one bounded piece of journal work: a chunk of output, queuing a
+// record or line in memory, or a single close or remove on the drive
+void journal_step(void) {
+    if(journal_pos < journal_len) {
+        journal_put_chunk();
+        return;
+    }
+    switch(journal_state) {
+        case JOURNAL_WRITING:
+            journal_next_record();
+            break;
+            
+        case JOURNAL_CLOSING:
+            fclose(journal_fp);
+            journal_state = JOURNAL_IDLE;
+            break;
+            
+        case JOURNAL_COMPACTING:
+            journal_compact_line();
+            break;
+            
+        case JOURNAL_COMPACTED:
+            fclose(journal_fp);
+            journal_state = JOURNAL_DROPPING;
+            break;
+            
+        case JOURNAL_DROPPING:
+            remove(JOURNAL_NAME);
+            journal_exists = 0;
+            journal_records = 0;
+            journal_state = JOURNAL_IDLE;
+            break;
+            
+        case JOURNAL_SNAPSHOT:
+            journal_snapshot_line();
+            break;
+            
+        case JOURNAL_SNAPSHOTTED:
+            fclose(journal_fp);
+            journal_state = JOURNAL_REPLACING;
+            break;
+            
+        case JOURNAL_REPLACING:
+            remove(JOURNAL_NAME);
+            journal_state = JOURNAL_RENAMING;
+            break;
+            
+        case JOURNAL_RENAMING:
+            // Recovery finishes this rename if it was cut short
+            if(rename(JOURNAL_TEMP, JOURNAL_NAME) != 0) {
+                journal_exists = 0;
+            }
+            journal_records = MAX_LINES;
+            journal_state = JOURNAL_IDLE;
+            break;
+    }
+}
+
+// Leaves no file open before other disk work. A batch of records is
+// written out, a main file or snapshot being compacted is completed.
+void journal_close(void) {
+    while(journal_state != JOURNAL_IDLE) {
+        journal_step();
+    }
+}
+
+void journal_reset(void) {
+    journal_close();
+    if(journal_exists) {
+        remove(JOURNAL_NAME);
+    }
+    memset(line_dirty, 0, sizeof(line_dirty));
+    journal_pending = 0;
+    journal_exists = 0;
+    journal_records = 0;
+}
+
+void journal_recover(void) {
+    FILE *fp;
+    FILE *main_fp;
+    unsigned char ok;
+    unsigned char main_missing = 0;
+    char *record = journal_buf;  // Free until autosave starts
+    unsigned int len;
+    unsigned char line_num;
+    char c;
+    unsigned char dialog_width = 40;
+    unsigned char dialog_height = 5;
+    unsigned char start_x = (SCREEN_WIDTH - dialog_width) / 2;
+    unsigned char start_y = (25 - dialog_height) / 2;
+    
+    // A snapshot that was complete but not yet renamed is the journal,
+    // one next to a journal was cut short
+    fp = fopen(JOURNAL_NAME, "r");
+    if(fp != NULL) {
+        remove(JOURNAL_TEMP);
+    }
+    else if(rename(JOURNAL_TEMP, JOURNAL_NAME) == 0) {
+        fp = fopen(JOURNAL_NAME, "r");
+    }
+    if(fp == NULL) return;
+    
+    draw_dialog("Recover", dialog_width, dialog_height);
+    gotoxy(start_x + 2, start_y + 2);
+    textcolor(2);  // Red for warning
+    cputs("Replay unsaved edits? (Y/N)");
+    c = cgetc();
+    if(c != 'y' && c != 'Y') {
+        fclose(fp);
+        remove(JOURNAL_NAME);
+        redraw_screen();
+        return;
+    }
+    
+    // The journal starts with the main file it applies to
+    ok = 0;
+    if(fgets(record, sizeof(journal_buf), fp) && record[0] == JOURNAL_NAME_RECORD) {
+        len = strlen(record);
+        if(len > 0 && record[len-1] == '\n') {
+            record[--len] = '\0';
+        }
+        strncpy(current_filename, record + 1, sizeof(current_filename) - 1);
+        
+        // Edits apply on top of the saved file, an unsaved document or
+        // one whose file is gone is replayed from empty
+        ok = 1;
+        if(current_filename[0] != '\0') {
+            main_fp = fopen(current_filename, "r");
+            if(main_fp != NULL) {
+                ok = read_document(main_fp);
+                fclose(main_fp);
+            }
+            else {
+                main_missing = 1;
+            }
+        }
+    }
+    
+    // Later records for the same line replace earlier ones
+    while(ok && fgets(record, sizeof(journal_buf), fp)) {
+        len = strlen(record);
+        if(len > 0 && record[len-1] == '\n') {
+            record[--len] = '\0';
+        }
+        if(len < 2) continue;
+        line_num = (record[0] - '0') * 10 + (record[1] - '0');
+        if(line_num < MAX_LINES) {
+            ok = doc_store(line_num, record + 2);  // Fails when out of memory
+            journal_records++;
+        }
+    }
+    fclose(fp);
+    
+    if(!ok) {
+        // Keep the journal on disk untouched and start empty
+        doc_clear();
+        current_filename[0] = '\0';
+        journal_records = 0;
+        journal_disabled = 1;
+        draw_dialog("Error", dialog_width, dialog_height);
+        gotoxy(start_x + 2, start_y + 2);
+        textcolor(2);  // Red
+        cputs("Recovery failed, autosave is off");
+        cgetc();
+    }
+    else {
+        journal_exists = 1;
+        if(main_missing) {
+            draw_dialog("Warning", dialog_width, dialog_height);
+            gotoxy(start_x + 2, start_y + 2);
+            textcolor(2);  // Red
+            cputs("File not found, edits replayed only");
+            cgetc();
+        }
+        else if(doc_altered) {
+            draw_dialog("Warning", dialog_width, dialog_height);
+            gotoxy(start_x + 2, start_y + 2);
+            textcolor(2);  // Red
+            cputs("File did not fit, text split or cut!");
+            cgetc();
+        }
+    }
+    
+    redraw_screen();
+}
+
+void queue_repaint_all(void) {
+    unsigned char i;
+    
+    // Empty lines are already blank after clrscr()
+    for(i = 0; i < MAX_LINES; i++) {
+        line_stale[i] = (doc_line(i)[0] != '\0');
+    }
+}
+
+unsigned char task_repaint(void) {
+    unsigned char i;
+    
+    for(i = 0; i < MAX_LINES; i++) {
+        if(line_stale[i]) {
+            line_stale[i] = 0;
+            format_line_without_cursor(i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Does one bounded step of journal work per call
+unsigned char task_autosave(void) {
+    unsigned char compact_due;
+    
+    if(journal_state != JOURNAL_IDLE) {
+        journal_step();
+        return 1;
+    }
+    
+    compact_due = journal_records >= JOURNAL_COMPACT_RECS;
+    if(!journal_pending && !compact_due) return 0;
+    
+    // Keeps the scheduler polling until the user has paused long enough
+    if((unsigned char)(PEEK(JIFFY_CLOCK_LO) - last_key_jiffy) >= JOURNAL_IDLE_JIFFIES) {
+        if(journal_pending) {
+            journal_open();
+        }
+        else if(file_saved && !doc_altered) {
+            journal_compact_start();
+        }
+        else {
+            journal_snapshot_start();
+        }
+    }
+    return 1;
+}
+
+unsigned int timer_elapsed(void) {
+    unsigned char hi, lo;
+    
+    // The timer is not latched, so retry if the high byte moved while
+    // the low byte was read
+    do {
+        hi = PEEK(CIA2_TIMER_B_HI);
+        lo = PEEK(CIA2_TIMER_B_LO);
+    } while(hi != PEEK(CIA2_TIMER_B_HI));
+    return 0xFFFF - (lo | ((unsigned int)hi << 8));
+}
+
+// Runs one slice of a task, returns 0 if it had nothing to do
+unsigned char run_slice(struct task *t) {
+    POKE(CIA2_TIMER_B_LO, 0xFF);
+    POKE(CIA2_TIMER_B_HI, 0xFF);
+    POKE(CIA2_CTRL_B, TIMER_START);
+    
+    if(!t->run()) return 0;
+    while(timer_elapsed() < t->budget && PEEK(KBD_BUFFER_COUNT) == 0) {
+        if(!t->run()) break;
+    }
+    return 1;
+}
+
+void run_idle_tasks(void) {
+    unsigned char i;
+    
+    // A pending key preempts at the next slice boundary
+    while(PEEK(KBD_BUFFER_COUNT) == 0) {
+        // After every slice start over from the highest priority
+        for(i = 0; i < TASK_COUNT; i++) {
+            if(run_slice(&tasks[i])) break;
+        }
+        if(i == TASK_COUNT) break;  // Nothing left to do
+    }
+    
+    gotoxy(cursor_x - scroll_x, cursor_y + HEADER_LINES + 1);
+}
+
 int main(void) {
     init_screen();
+    journal_recover();
     
     while(1) {
         handle_input();